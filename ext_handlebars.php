@@ -3,6 +3,9 @@
 <<__Native>>
 function handlebars_error(): ?string;
 
+<<__Native>>
+function handlebars_error_location(): ?array;
+
 <<__Native>>
 function handlebars_lex(string $tmpl): array;
 
@@ -37,6 +40,15 @@ class HandlebarsNative {
     <<__Native>>
     static function getLastError(): mixed;
 
+    /**
+     * Get the template position of the last error, if known. Only parse
+     * errors carry a position.
+     *
+     * @return array|null first_line, first_column, last_line, last_column
+     */
+    <<__Native>>
+    static function getLastErrorLocation(): mixed;
+
     /**
      * Tokenize a template and return an array of tokens
      *
@@ -101,6 +113,96 @@ class HandlebarsNative {
      */
     <<__Native>>
     static function version(): string;
+
+    /**
+     * Start profiling template rendering for the current request. Clears
+     * any previously collected samples.
+     *
+     * @param integer $sampleRate Record one in every $sampleRate outermost renders
+     * @return void
+     */
+    <<__Native>>
+    static function profilerStart(int $sampleRate = 1): void;
+
+    /**
+     * Stop profiling. Collected samples are kept until the next start or
+     * the end of the request.
+     *
+     * @return void
+     */
+    <<__Native>>
+    static function profilerStop(): void;
+
+    /**
+     * Check if profiling is enabled. Renderers should check this once per
+     * render and skip the enter/leave calls entirely when it is off.
+     *
+     * @return boolean
+     */
+    <<__Native>>
+    static function profilerEnabled(): bool;
+
+    /**
+     * Enter a profiled frame, e.g. "helper:each", "partial:header" or
+     * "program:3" (compiler child index)
+     *
+     * @param string $frame
+     * @return integer The depth to pass to profilerLeave(), or -1 if disabled
+     */
+    <<__Native>>
+    static function profilerEnter(string $frame): int;
+
+    /**
+     * Leave a frame, closing any frames entered after it that were left
+     * open. Call this from a finally block so exceptions thrown by helpers
+     * and partials don't leave frames open.
+     *
+     * @param integer $depth The value returned by profilerEnter()
+     * @return void
+     */
+    <<__Native>>
+    static function profilerLeave(int $depth): void;
+
+    /**
+     * Get the collected samples as folded stacks ("a;b;c value" per line),
+     * suitable for flamegraph.pl
+     *
+     * @param boolean $calls Report call counts instead of self time in nanoseconds
+     * @return string
+     */
+    <<__Native>>
+    static function profilerDump(bool $calls = false): string;
+
+    /**
+     * Store compiled opcodes in the process-wide template store, replacing
+     * any previous version. The store is shared by all requests; requests
+     * already holding the previous version keep using it.
+     *
+     * @param string $name
+     * @param array $compiled
+     * @return void
+     * @throws \Handlebars\Exception If the array contains objects, resources or references
+     */
+    <<__Native>>
+    static function storeSet(string $name, array $compiled): void;
+
+    /**
+     * Fetch compiled opcodes from the process-wide template store
+     *
+     * @param string $name
+     * @return array|null
+     */
+    <<__Native>>
+    static function storeGet(string $name): mixed;
+
+    /**
+     * Remove a template from the process-wide template store
+     *
+     * @param string $name
+     * @return boolean True if the template was present
+     */
+    <<__Native>>
+    static function storeDelete(string $name): bool;
 }
 
 namespace Handlebars;
@@ -112,6 +214,20 @@ class Native extends \HandlebarsNative {}
 class Exception extends BaseException {}
 class CompileException extends Exception {}
 class LexException extends Exception {}
-class ParseException extends Exception {}
+class ParseException extends Exception {
+    /**
+     * @var array|null first_line, first_column, last_line, last_column
+     */
+    protected $templateLocation;
+
+    /**
+     * Get the template position of the error, if known
+     *
+     * @return array|null
+     */
+    public function getTemplateLocation() {
+        return $this->templateLocation;
+    }
+}
 class RuntimeException extends Exception {}
 
@@ -1,5 +1,12 @@
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
 #include <string>
+#include <utility>
+#include <vector>
 #include <talloc.h>
 
 #include "hphp/runtime/ext/extension.h"
@@ -11,6 +18,12 @@
 #include "hphp/util/string-vsnprintf.h"
 #include "hphp/runtime/base/array-init.h"
 #include "hphp/runtime/base/execution-context.h"
+#include "hphp/runtime/base/request-local.h"
+#include "hphp/runtime/base/mixed-array.h"
+#include "hphp/runtime/base/packed-array.h"
+#include "hphp/runtime/vm/treadmill.h"
+
+#include <folly/Range.h>
 
 extern "C" {
 #include "handlebars.h"
@@ -36,13 +49,99 @@ int handlebars_yy_parse (struct handlebars_context * context);
 namespace HPHP {
 
 static const char * HANDLEBARS_VERSION = "0.3.2";
-static std::string handlebars_last_error;
 static HPHP::Class * s_HandlebarsExceptionClass = nullptr;
 static HPHP::Class * s_HandlebarsCompileExceptionClass = nullptr;
 static HPHP::Class * s_HandlebarsLexExceptionClass = nullptr;
 static HPHP::Class * s_HandlebarsParseExceptionClass = nullptr;
 
-static Array hhvm_handlebars_ast_node_to_array(struct handlebars_ast_node * node);
+const StaticString s_args("args");
+const StaticString s_boolean("boolean");
+const StaticString s_children("children");
+const StaticString s_close("close");
+const StaticString s_closeStandalone("closeStandalone");
+const StaticString s_comment("comment");
+const StaticString s_context("context");
+const StaticString s_depth("depth");
+const StaticString s_depths("depths");
+const StaticString s_first_column("first_column");
+const StaticString s_first_line("first_line");
+const StaticString s_hash("hash");
+const StaticString s_id("id");
+const StaticString s_id_name("id_name");
+const StaticString s_inlineStandalone("inlineStandalone");
+const StaticString s_inverse("inverse");
+const StaticString s_inverted("inverted");
+const StaticString s_is_scoped("is_scoped");
+const StaticString s_is_simple("is_simple");
+const StaticString s_key("key");
+const StaticString s_last_column("last_column");
+const StaticString s_last_line("last_line");
+const StaticString s_left("left");
+const StaticString s_leftStripped("leftStripped");
+const StaticString s_mustache("mustache");
+const StaticString s_name("name");
+const StaticString s_number("number");
+const StaticString s_opcode("opcode");
+const StaticString s_opcodes("opcodes");
+const StaticString s_openStandalone("openStandalone");
+const StaticString s_original("original");
+const StaticString s_params("params");
+const StaticString s_part("part");
+const StaticString s_partial_name("partial_name");
+const StaticString s_parts("parts");
+const StaticString s_program("program");
+const StaticString s_right("right");
+const StaticString s_rightStriped("rightStriped");
+const StaticString s_segments("segments");
+const StaticString s_separator("separator");
+const StaticString s_sexpr("sexpr");
+const StaticString s_statements("statements");
+const StaticString s_string("string");
+const StaticString s_strip("strip");
+const StaticString s_templateLocation("templateLocation");
+const StaticString s_text("text");
+const StaticString s_type("type");
+const StaticString s_unescaped("unescaped");
+const StaticString s_value("value");
+
+/**
+ * Last error of the current request. The message and its template location
+ * are kept together so they can't be paired up across requests.
+ */
+struct HandlebarsLastError final : RequestEventHandler {
+    std::string message;
+    bool hasLocation;
+    int firstLine;
+    int firstColumn;
+    int lastLine;
+    int lastColumn;
+
+    HandlebarsLastError() { clear(); }
+
+    void requestInit() override { clear(); }
+    void requestShutdown() override { clear(); }
+
+    void clear() {
+        message.clear();
+        hasLocation = false;
+        firstLine = firstColumn = lastLine = lastColumn = 0;
+    }
+
+    Variant location() const {
+        Variant ret;
+        if( message.length() && hasLocation ) {
+            MixedArrayInit loc(4);
+            loc.set(s_first_line, (int64_t) firstLine);
+            loc.set(s_first_column, (int64_t) firstColumn);
+            loc.set(s_last_line, (int64_t) lastLine);
+            loc.set(s_last_column, (int64_t) lastColumn);
+            ret = loc.toArray();
+        }
+        return ret;
+    }
+};
+
+IMPLEMENT_STATIC_REQUEST_LOCAL(HandlebarsLastError, s_handlebars_last_error);
 
 static ObjectData * AllocHandlebarsExceptionObject(Class * cls, const Variant& message) {
   ObjectData* inst = ObjectData::newInstance(cls);
@@ -57,6 +156,32 @@ static ObjectData * AllocHandlebarsExceptionObject(Class * cls, const Variant& m
   return inst;
 }
 
+static void hhvm_handlebars_set_parse_error(struct handlebars_context * ctx) {
+    s_handlebars_last_error->message.assign(handlebars_context_get_errmsg(ctx));
+    s_handlebars_last_error->hasLocation = (ctx->errloc != NULL);
+    if( ctx->errloc ) {
+        s_handlebars_last_error->firstLine = ctx->errloc->first_line;
+        s_handlebars_last_error->firstColumn = ctx->errloc->first_column;
+        s_handlebars_last_error->lastLine = ctx->errloc->last_line;
+        s_handlebars_last_error->lastColumn = ctx->errloc->last_column;
+    }
+}
+
+static void hhvm_handlebars_set_compile_error(struct handlebars_compiler * compiler) {
+    // The compiler works on the AST, which carries no source positions
+    s_handlebars_last_error->message.assign(compiler->error);
+    s_handlebars_last_error->hasLocation = false;
+}
+
+static Object hhvm_handlebars_last_error_exception(Class * cls) {
+    String message(s_handlebars_last_error->message);
+    Object ex(AllocHandlebarsExceptionObject(cls, message));
+    if( cls == s_HandlebarsParseExceptionClass ) {
+        ex->o_set(s_templateLocation, s_handlebars_last_error->location(), cls->nameStr());
+    }
+    return ex;
+}
+
 static char ** hhvm_handlebars_known_helpers_from_variant(struct handlebars_context * ctx, const Variant & knownHelpers) {
     if( !knownHelpers.isArray() ) {
         return NULL;
@@ -92,104 +217,90 @@ static char ** hhvm_handlebars_known_helpers_from_variant(struct handlebars_cont
     return known_helpers;
 }
 
-static void hhvm_handlebars_operand_array_append(struct handlebars_operand * operand, Array & arr) {
+static Variant hhvm_handlebars_operand_to_variant(struct handlebars_operand * operand) {
     switch( operand->type ) {
-        case handlebars_operand_type_null:
-            arr.append(Variant());
-            break;
         case handlebars_operand_type_boolean:
-            arr.append((bool) operand->data.boolval);
-            break;
+            return (bool) operand->data.boolval;
         case handlebars_operand_type_long:
-            arr.append((int64_t) operand->data.longval);
-            break;
+            return (int64_t) operand->data.longval;
         case handlebars_operand_type_string:
-            arr.append(String(operand->data.stringval));
-            break;
+            return String(operand->data.stringval);
         case handlebars_operand_type_array: {
-            Array current;
-            char ** tmp = operand->data.arrayval;
-            for( ; *tmp; ++tmp ) {
+            char ** tmp;
+            size_t count = 0;
+            for( tmp = operand->data.arrayval; *tmp; ++tmp, ++count );
+
+            // Empty array operands have always been exported as null
+            if( count == 0 ) {
+                return Variant();
+            }
+
+            PackedArrayInit current(count);
+            for( tmp = operand->data.arrayval; *tmp; ++tmp ) {
                 current.append(String(*tmp));
             }
-            arr.append(current);
-            break;
+            return current.toArray();
         }
+        case handlebars_operand_type_null:
+        default:
+            return Variant();
     }
 }
 
 static Array hhvm_handlebars_opcode_to_array(struct handlebars_opcode * opcode) {
-    Array current;
-    Array args;
+    MixedArrayInit current(2);
     const char * name = handlebars_opcode_readable_type(opcode->type);
     short num = handlebars_opcode_num_operands(opcode->type);
 
-    current.add(String("opcode"), String(name));
-
-    // coerce to array
-    args.append(0);
-    args.pop();
+    current.set(s_opcode, String(name));
 
+    PackedArrayInit args(num > 0 ? num : 0);
     if( num >= 1 ) {
-        hhvm_handlebars_operand_array_append(&opcode->op1, args);
+        args.append(hhvm_handlebars_operand_to_variant(&opcode->op1));
     }
     if( num >= 2 ) {
-        hhvm_handlebars_operand_array_append(&opcode->op2, args);
+        args.append(hhvm_handlebars_operand_to_variant(&opcode->op2));
     }
     if( num >= 3 ) {
-        hhvm_handlebars_operand_array_append(&opcode->op3, args);
+        args.append(hhvm_handlebars_operand_to_variant(&opcode->op3));
     }
 
-    current.add(String("args"), args);
+    current.set(s_args, args.toArray());
 
-    return current;
+    return current.toArray();
 }
 
 static Array hhvm_handlebars_opcodes_to_array(struct handlebars_opcode ** opcodes, size_t count) {
-    Array current;
+    PackedArrayInit current(count);
     size_t i;
     struct handlebars_opcode ** pos = opcodes;
 
-    // coerce to array
-    current.append(0);
-    current.pop();
-    
     for( i = 0; i < count; i++, pos++ ) {
         current.append(hhvm_handlebars_opcode_to_array(*pos));
     }
 
-    return current;
+    return current.toArray();
 }
 
-static Array hhvm_handlebars_compiler_to_array(struct handlebars_compiler * compiler) {
-
-    Array current;
-    Array children;
+static Array hhvm_handlebars_compiler_frame_to_array(struct handlebars_compiler * compiler, const Array * child) {
+    MixedArrayInit current(3);
     size_t i;
 
-    // coerce to array
-    children.append(0);
-    children.pop();
-
     // Opcodes
-    current.add(String("opcodes"), hhvm_handlebars_opcodes_to_array(compiler->opcodes, compiler->opcodes_length));
+    current.set(s_opcodes, hhvm_handlebars_opcodes_to_array(compiler->opcodes, compiler->opcodes_length));
 
-    // Children
-    for( i = 0; i < compiler->children_length; i++ ) {
-        struct handlebars_compiler * child = *(compiler->children + i);
-        children.append(hhvm_handlebars_compiler_to_array(child));
+    // Children (already converted, in order)
+    PackedArrayInit children(compiler->children_length);
+    for( i = 0; i < compiler->children_length; i++, child++ ) {
+        children.append(*child);
     }
 
-    current.add(String("children"), children);
+    current.set(s_children, children.toArray());
 
     // Add depths
-    long depths = compiler->depths;
-    int depthi = 0;
-    Array zdepths;
-
-    // coerce to array
-    zdepths.append(0);
-    zdepths.pop();
+    unsigned long depths = (unsigned long) compiler->depths;
+    int64_t depthi = 0;
+    PackedArrayInit zdepths(__builtin_popcountl(depths));
 
     while( depths > 0 ) {
         if( depths & 1 ) {
@@ -199,230 +310,405 @@ static Array hhvm_handlebars_compiler_to_array(struct handlebars_compiler * comp
         depths = depths >> 1;
     }
 
-    current.add(String("depths"), zdepths);
+    current.set(s_depths, zdepths.toArray());
 
     // Return
-    return current;
+    return current.toArray();
 }
 
-static Array hhvm_handlebars_ast_list_to_array(struct handlebars_ast_list * list) {
-    Array current;
+static Array hhvm_handlebars_compiler_to_array(struct handlebars_compiler * compiler) {
+    // Walk the compiler tree with an explicit stack instead of recursing, so
+    // deeply nested templates don't eat native stack. Each compiler is visited
+    // twice: once to push its children, once to assemble it from the converted
+    // children sitting on top of the value stack.
+    std::vector<std::pair<struct handlebars_compiler *, bool>> work;
+    std::vector<Array> values;
+    size_t i;
+
+    work.emplace_back(compiler, false);
+
+    while( !work.empty() ) {
+        struct handlebars_compiler * current = work.back().first;
+
+        if( !work.back().second ) {
+            work.back().second = true;
+            // Push in reverse so the results land on the value stack in order
+            for( i = current->children_length; i > 0; i-- ) {
+                work.emplace_back(*(current->children + i - 1), false);
+            }
+            continue;
+        }
+
+        work.pop_back();
+
+        size_t base = values.size() - current->children_length;
+        Array result = hhvm_handlebars_compiler_frame_to_array(current, values.data() + base);
+        values.resize(base);
+        values.push_back(std::move(result));
+    }
+
+    return values.back();
+}
+
+struct hhvm_handlebars_ast_frame {
+    struct handlebars_ast_node * node;
+    struct handlebars_ast_list * list;
+    size_t count;
+    bool expanded;
+};
+
+static inline void hhvm_handlebars_ast_frame_push_node(std::vector<hhvm_handlebars_ast_frame> & work, struct handlebars_ast_node * node) {
+    work.push_back({node, NULL, 0, false});
+}
+
+static inline void hhvm_handlebars_ast_frame_push_list(std::vector<hhvm_handlebars_ast_frame> & work, struct handlebars_ast_list * list) {
+    work.push_back({NULL, list, 0, false});
+}
+
+/**
+ * Push the child nodes and lists of a node onto the work stack, in the same
+ * order hhvm_handlebars_ast_frame_to_array() consumes them. Returns the number
+ * of frames pushed.
+ */
+static size_t hhvm_handlebars_ast_node_push_children(std::vector<hhvm_handlebars_ast_frame> & work, struct handlebars_ast_node * node) {
+    size_t base = work.size();
+
+    switch( node->type ) {
+        case HANDLEBARS_AST_NODE_PROGRAM:
+            if( node->node.program.statements ) {
+                hhvm_handlebars_ast_frame_push_list(work, node->node.program.statements);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_MUSTACHE:
+            if( node->node.mustache.sexpr ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.mustache.sexpr);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_SEXPR:
+            if( node->node.sexpr.hash ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.sexpr.hash);
+            }
+            if( node->node.sexpr.id ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.sexpr.id);
+            }
+            if( node->node.sexpr.params ) {
+                hhvm_handlebars_ast_frame_push_list(work, node->node.sexpr.params);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_PARTIAL:
+            if( node->node.partial.partial_name ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.partial.partial_name);
+            }
+            if( node->node.partial.context ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.partial.context);
+            }
+            if( node->node.partial.hash ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.partial.hash);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_RAW_BLOCK:
+            if( node->node.raw_block.mustache ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.raw_block.mustache);
+            }
+            if( node->node.raw_block.program ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.raw_block.program);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_BLOCK:
+            if( node->node.block.mustache ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.block.mustache);
+            }
+            if( node->node.block.program ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.block.program);
+            }
+            if( node->node.block.inverse ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.block.inverse);
+            }
+            if( node->node.block.close ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.block.close);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_HASH:
+            if( node->node.hash.segments ) {
+                hhvm_handlebars_ast_frame_push_list(work, node->node.hash.segments);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_HASH_SEGMENT:
+            if( node->node.hash_segment.value ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.hash_segment.value);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_ID:
+            if( node->node.id.parts ) {
+                hhvm_handlebars_ast_frame_push_list(work, node->node.id.parts);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_PARTIAL_NAME:
+            if( node->node.partial_name.name ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.partial_name.name);
+            }
+            break;
+        case HANDLEBARS_AST_NODE_DATA:
+            if( node->node.data.id ) {
+                hhvm_handlebars_ast_frame_push_node(work, node->node.data.id);
+            }
+            break;
+        default:
+            break;
+    }
+
+    // Reverse so the children are popped (and converted) in order
+    std::reverse(work.begin() + base, work.end());
+
+    return work.size() - base;
+}
 
+/**
+ * Push the items of a list onto the work stack in reverse. Returns the number
+ * of frames pushed.
+ */
+static size_t hhvm_handlebars_ast_list_push_children(std::vector<hhvm_handlebars_ast_frame> & work, struct handlebars_ast_list * list) {
+    size_t base = work.size();
     struct handlebars_ast_list_item * item;
     struct handlebars_ast_list_item * tmp;
 
-    if( list == NULL ) {
-        return current;
+    handlebars_ast_list_foreach(list, item, tmp) {
+        hhvm_handlebars_ast_frame_push_node(work, item->data);
     }
 
-    handlebars_ast_list_foreach(list, item, tmp) {
-        current.append(hhvm_handlebars_ast_node_to_array(item->data));
+    std::reverse(work.begin() + base, work.end());
+
+    return work.size() - base;
+}
+
+static Array hhvm_handlebars_ast_list_frame_to_array(size_t count, const Array * child) {
+    // Empty lists have always been exported as null
+    if( count == 0 ) {
+        return Array();
+    }
+
+    PackedArrayInit current(count);
+    for( ; count > 0; count--, child++ ) {
+        current.append(*child);
     }
 
-    return current;
+    return current.toArray();
 }
 
-static Array hhvm_handlebars_ast_node_to_array(struct handlebars_ast_node * node) {
-    Array current;
+/**
+ * Upper bound on the number of keys hhvm_handlebars_ast_frame_to_array() will
+ * set for a node, so the map can be allocated up front.
+ */
+static size_t hhvm_handlebars_ast_node_key_count(struct handlebars_ast_node * node) {
+    // type + strip
+    size_t count = node->strip > 0 ? 2 : 1;
 
-    if( node == NULL ) {
-        return current;
+    switch( node->type ) {
+        case HANDLEBARS_AST_NODE_ID:
+            return count + 7;
+        case HANDLEBARS_AST_NODE_BLOCK:
+            return count + 5;
+        case HANDLEBARS_AST_NODE_SEXPR:
+        case HANDLEBARS_AST_NODE_PARTIAL:
+        case HANDLEBARS_AST_NODE_RAW_BLOCK:
+            return count + 3;
+        case HANDLEBARS_AST_NODE_MUSTACHE:
+        case HANDLEBARS_AST_NODE_CONTENT:
+        case HANDLEBARS_AST_NODE_HASH_SEGMENT:
+        case HANDLEBARS_AST_NODE_PATH_SEGMENT:
+            return count + 2;
+        case HANDLEBARS_AST_NODE_PROGRAM:
+        case HANDLEBARS_AST_NODE_HASH:
+        case HANDLEBARS_AST_NODE_PARTIAL_NAME:
+        case HANDLEBARS_AST_NODE_DATA:
+        case HANDLEBARS_AST_NODE_STRING:
+        case HANDLEBARS_AST_NODE_NUMBER:
+        case HANDLEBARS_AST_NODE_BOOLEAN:
+        case HANDLEBARS_AST_NODE_COMMENT:
+            return count + 1;
+        default:
+            return count;
     }
+}
+
+static Array hhvm_handlebars_ast_frame_to_array(struct handlebars_ast_node * node, const Array * child) {
+    MixedArrayInit current(hhvm_handlebars_ast_node_key_count(node));
 
-    current.add(String("type"), HPHP::String::FromCStr(handlebars_ast_node_readable_type(node->type)));
+    current.set(s_type, HPHP::String::FromCStr(handlebars_ast_node_readable_type(node->type)));
 
     if( node->strip > 0 ) {
-        Array strip;
-        strip.add(String("left"), (bool) (node->strip & handlebars_ast_strip_flag_left));
-        strip.add(String("right"), (bool) (node->strip & handlebars_ast_strip_flag_right));
-        strip.add(String("openStandalone"), (bool) (node->strip & handlebars_ast_strip_flag_open_standalone));
-        strip.add(String("closeStandalone"), (bool) (node->strip & handlebars_ast_strip_flag_close_standalone));
-        strip.add(String("inlineStandalone"), (bool) (node->strip & handlebars_ast_strip_flag_inline_standalone));
-        strip.add(String("leftStripped"), (bool) (node->strip & handlebars_ast_strip_flag_left_stripped));
-        strip.add(String("rightStriped"), (bool) (node->strip & handlebars_ast_strip_flag_right_stripped));
-        current.add(String("strip"), strip);
+        MixedArrayInit strip(7);
+        strip.set(s_left, (bool) (node->strip & handlebars_ast_strip_flag_left));
+        strip.set(s_right, (bool) (node->strip & handlebars_ast_strip_flag_right));
+        strip.set(s_openStandalone, (bool) (node->strip & handlebars_ast_strip_flag_open_standalone));
+        strip.set(s_closeStandalone, (bool) (node->strip & handlebars_ast_strip_flag_close_standalone));
+        strip.set(s_inlineStandalone, (bool) (node->strip & handlebars_ast_strip_flag_inline_standalone));
+        strip.set(s_leftStripped, (bool) (node->strip & handlebars_ast_strip_flag_left_stripped));
+        strip.set(s_rightStriped, (bool) (node->strip & handlebars_ast_strip_flag_right_stripped));
+        current.set(s_strip, strip.toArray());
     }
 
 
     switch( node->type ) {
         case HANDLEBARS_AST_NODE_PROGRAM: {
             if( node->node.program.statements ) {
-                current.add(String("statements"),
-                        hhvm_handlebars_ast_list_to_array(node->node.program.statements));
+                current.set(s_statements, *child++);
             }
             break;
         }
         case HANDLEBARS_AST_NODE_MUSTACHE: {
             if( node->node.mustache.sexpr ) {
-                current.add(String("sexpr"),
-                    hhvm_handlebars_ast_node_to_array(node->node.mustache.sexpr));
+                current.set(s_sexpr, *child++);
             }
-            current.add(String("unescaped"), (bool) node->node.mustache.unescaped);
+            current.set(s_unescaped, (bool) node->node.mustache.unescaped);
             break;
         }
         case HANDLEBARS_AST_NODE_SEXPR: {
             if( node->node.sexpr.hash ) {
-                current.add(String("hash"),
-                        hhvm_handlebars_ast_node_to_array(node->node.sexpr.hash));
+                current.set(s_hash, *child++);
             }
             if( node->node.sexpr.id ) {
-                current.add(String("id"),
-                        hhvm_handlebars_ast_node_to_array(node->node.sexpr.id));
+                current.set(s_id, *child++);
             }
             if( node->node.sexpr.params ) {
-                current.add(String("params"),
-                        hhvm_handlebars_ast_list_to_array(node->node.sexpr.params));
+                current.set(s_params, *child++);
             }
             break;
         }
         case HANDLEBARS_AST_NODE_PARTIAL:
             if( node->node.partial.partial_name ) {
-                current.add(String("partial_name"),
-                        hhvm_handlebars_ast_node_to_array(node->node.partial.partial_name));
+                current.set(s_partial_name, *child++);
             }
             if( node->node.partial.context ) {
-                current.add(String("context"),
-                        hhvm_handlebars_ast_node_to_array(node->node.partial.context));
+                current.set(s_context, *child++);
             }
             if( node->node.partial.hash ) {
-                current.add(String("hash"),
-                        hhvm_handlebars_ast_node_to_array(node->node.partial.hash));
+                current.set(s_hash, *child++);
             }
             break;
         case HANDLEBARS_AST_NODE_RAW_BLOCK: {
             if( node->node.raw_block.mustache ) {
-                current.add(String("mustache"),
-                        hhvm_handlebars_ast_node_to_array(node->node.raw_block.mustache));
+                current.set(s_mustache, *child++);
             }
             if( node->node.raw_block.program ) {
-                current.add(String("program"),
-                        hhvm_handlebars_ast_node_to_array(node->node.raw_block.program));
+                current.set(s_program, *child++);
             }
             if( node->node.raw_block.close ) {
-                current.add(String("close"), String(node->node.raw_block.close));
+                current.set(s_close, String(node->node.raw_block.close));
             }
             break;
         }
         case HANDLEBARS_AST_NODE_BLOCK: {
             if( node->node.block.mustache ) {
-                current.add(String("mustache"),
-                        hhvm_handlebars_ast_node_to_array(node->node.block.mustache));
+                current.set(s_mustache, *child++);
             }
             if( node->node.block.program ) {
-                current.add(String("program"),
-                        hhvm_handlebars_ast_node_to_array(node->node.block.program));
+                current.set(s_program, *child++);
             }
             if( node->node.block.inverse ) {
-                current.add(String("inverse"),
-                        hhvm_handlebars_ast_node_to_array(node->node.block.inverse));
+                current.set(s_inverse, *child++);
             }
             if( node->node.block.close ) {
-                current.add(String("close"),
-                        hhvm_handlebars_ast_node_to_array(node->node.block.close));
+                current.set(s_close, *child++);
             }
-            current.add(String("inverted"), node->node.block.inverted);
+            current.set(s_inverted, node->node.block.inverted);
             break;
         }
         case HANDLEBARS_AST_NODE_CONTENT: {
             if( node->node.content.string ) {
-                current.add(String("string"),
+                current.set(s_string,
                     String(node->node.content.string));
             }
             if( node->node.content.original ) {
-                current.add(String("original"),
+                current.set(s_original,
                     String(node->node.content.original));
             }
             break;
         }
         case HANDLEBARS_AST_NODE_HASH: {
             if( node->node.hash.segments ) {
-                current.add(String("segments"),
-                        hhvm_handlebars_ast_list_to_array(node->node.hash.segments));
+                current.set(s_segments, *child++);
             }
             break;
         }
         case HANDLEBARS_AST_NODE_HASH_SEGMENT: {
             if( node->node.hash_segment.key ) {
-                current.add(String("key"),
+                current.set(s_key,
                     String(node->node.hash_segment.key));
             }
             if( node->node.hash_segment.value ) {
-                current.add(String("value"),
-                        hhvm_handlebars_ast_node_to_array(node->node.hash_segment.value));
+                current.set(s_value, *child++);
             }
             break;
         }
         case HANDLEBARS_AST_NODE_ID: {
             if( node->node.id.parts ) {
-                current.add(String("parts"),
-                        hhvm_handlebars_ast_list_to_array(node->node.id.parts));
+                current.set(s_parts, *child++);
             }
-            current.add(String("depth"), (int64_t) node->node.id.depth);
-            current.add(String("is_simple"), (int64_t) node->node.id.is_simple);
-            current.add(String("is_scoped"), (int64_t) node->node.id.is_scoped);
+            current.set(s_depth, (int64_t) node->node.id.depth);
+            current.set(s_is_simple, (int64_t) node->node.id.is_simple);
+            current.set(s_is_scoped, (int64_t) node->node.id.is_scoped);
             if( node->node.id.id_name ) {
-                current.add(String("id_name"),
+                current.set(s_id_name,
                     String(node->node.id.id_name));
             }
             if( node->node.id.string ) {
-                current.add(String("string"),
+                current.set(s_string,
                     String(node->node.id.string));
             }
             if( node->node.id.original ) {
-                current.add(String("original"),
+                current.set(s_original,
                     String(node->node.id.original));
             }
             break;
         }
         case HANDLEBARS_AST_NODE_PARTIAL_NAME: {
             if( node->node.partial_name.name ) {
-                current.add(String("name"),
-                        hhvm_handlebars_ast_node_to_array(node->node.partial_name.name));
+                current.set(s_name, *child++);
             }
             break;
         }
         case HANDLEBARS_AST_NODE_DATA: {
             if( node->node.data.id ) {
-                current.add(String("id"),
-                        hhvm_handlebars_ast_node_to_array(node->node.data.id));
+                current.set(s_id, *child++);
             }
             break;
         }
         case HANDLEBARS_AST_NODE_STRING: {
             if( node->node.string.string ) {
-                current.add(String("string"),
+                current.set(s_string,
                     String(node->node.string.string));
             }
             break;
         }
         case HANDLEBARS_AST_NODE_NUMBER: {
             if( node->node.number.string ) {
-                current.add(String("number"),
+                current.set(s_number,
                     String(node->node.number.string));
             }
             break;
         }
         case HANDLEBARS_AST_NODE_BOOLEAN: {
             if( node->node.boolean.string ) {
-                current.add(String("boolean"),
+                current.set(s_boolean,
                     String(node->node.boolean.string));
             }
             break;
         }
         case HANDLEBARS_AST_NODE_COMMENT: {
             if( node->node.comment.comment ) {
-                current.add(String("comment"),
+                current.set(s_comment,
                     String(node->node.comment.comment));
             }
             break;
         }
         case HANDLEBARS_AST_NODE_PATH_SEGMENT: {
             if( node->node.path_segment.separator ) {
-                current.add(String("separator"),
+                current.set(s_separator,
                     String(node->node.path_segment.separator));
             }
             if( node->node.path_segment.part ) {
-                current.add(String("part"),
+                current.set(s_part,
                     String(node->node.path_segment.part));
             }
             break;
@@ -434,15 +720,65 @@ static Array hhvm_handlebars_ast_node_to_array(struct handlebars_ast_node * node
             break;
     }
 
-    return current;
+    return current.toArray();
+}
+
+
+static Array hhvm_handlebars_ast_node_to_array(struct handlebars_ast_node * node) {
+    // Walk the AST with an explicit stack instead of recursing, so deeply
+    // nested templates don't eat native stack. Each node or list is visited
+    // twice: once to push its children, once to assemble it from the converted
+    // children sitting on top of the value stack.
+    std::vector<hhvm_handlebars_ast_frame> work;
+    std::vector<Array> values;
+
+    hhvm_handlebars_ast_frame_push_node(work, node);
+
+    while( !work.empty() ) {
+        size_t top = work.size() - 1;
+
+        if( work[top].node == NULL && work[top].list == NULL ) {
+            work.pop_back();
+            values.push_back(Array());
+            continue;
+        }
+
+        if( !work[top].expanded ) {
+            // Pushing may reallocate the stack, so don't hold references into it
+            size_t count;
+            if( work[top].list ) {
+                count = hhvm_handlebars_ast_list_push_children(work, work[top].list);
+            } else {
+                count = hhvm_handlebars_ast_node_push_children(work, work[top].node);
+            }
+            work[top].expanded = true;
+            work[top].count = count;
+            continue;
+        }
+
+        hhvm_handlebars_ast_frame frame = work.back();
+        work.pop_back();
+
+        size_t base = values.size() - frame.count;
+        Array result;
+        if( frame.list ) {
+            result = hhvm_handlebars_ast_list_frame_to_array(frame.count, values.data() + base);
+        } else {
+            result = hhvm_handlebars_ast_frame_to_array(frame.node, values.data() + base);
+        }
+        values.resize(base);
+        values.push_back(std::move(result));
+    }
+
+    return values.back();
 }
 
 /* {{{ proto string handlebars_error(void) */
 
 static inline Variant hhvm_handlebars_get_last_error() {
     Variant ret;
-    if( handlebars_last_error.length() ) {
-        ret = HPHP::String::FromCStr(handlebars_last_error.c_str());
+    if( s_handlebars_last_error->message.length() ) {
+        ret = String(s_handlebars_last_error->message);
     }
     return ret;
 }
@@ -456,6 +792,21 @@ Variant HHVM_STATIC_METHOD(HandlebarsNative, getLastError) {
 }
 
 /* }}} handlebars_error */
+/* {{{ proto array handlebars_error_location(void) */
+
+static inline Variant hhvm_handlebars_get_last_error_location() {
+    return s_handlebars_last_error->location();
+}
+
+Variant HHVM_FUNCTION(handlebars_error_location) {
+    return hhvm_handlebars_get_last_error_location();
+}
+
+Variant HHVM_STATIC_METHOD(HandlebarsNative, getLastErrorLocation) {
+    return hhvm_handlebars_get_last_error_location();
+}
+
+/* }}} handlebars_error_location */
 /* {{{ proto mixed handlebars_lex(string tmpl) */
 
 static inline Array hhvm_handlebars_lex(const String& tmpl) {
@@ -464,20 +815,31 @@ static inline Array hhvm_handlebars_lex(const String& tmpl) {
 
     struct handlebars_token_list * list = handlebars_lex(ctx);
 
-    Array ret;
     struct handlebars_token_list_item * el = NULL;
     struct handlebars_token_list_item * tmp = NULL;
+    size_t count = 0;
+    handlebars_token_list_foreach(list, el, tmp) {
+        count++;
+    }
+
+    // An empty token list has always been exported as null
+    if( count == 0 ) {
+        handlebars_context_dtor(ctx);
+        return Array();
+    }
+
+    PackedArrayInit ret(count);
     handlebars_token_list_foreach(list, el, tmp) {
         struct handlebars_token * token = el->data;
-        Array child;
-        child.add(String("name"), HPHP::String::FromCStr(handlebars_token_readable_type(token->token)));
-        child.add(String("text"), HPHP::String::FromCStr(token->text));
-        ret.append(child);
+        MixedArrayInit child(2);
+        child.set(s_name, HPHP::String::FromCStr(handlebars_token_readable_type(token->token)));
+        child.set(s_text, HPHP::String::FromCStr(token->text));
+        ret.append(child.toArray());
     }
 
     handlebars_context_dtor(ctx);
 
-    return ret;
+    return ret.toArray();
 }
 
 Array HHVM_FUNCTION(handlebars_lex, const String& tmpl) {
@@ -525,9 +887,9 @@ static inline Variant hhvm_handlebars_parse(const String& tmpl, bool exceptions)
     Variant ret;
     if( ctx->error != NULL ) {
         ret = false;
-        handlebars_last_error.assign(handlebars_context_get_errmsg(ctx));
+        hhvm_handlebars_set_parse_error(ctx);
 	    if( exceptions ) {
-            throw Object(AllocHandlebarsExceptionObject(s_HandlebarsParseExceptionClass, handlebars_last_error));
+            throw hhvm_handlebars_last_error_exception(s_HandlebarsParseExceptionClass);
         }
     } else {
         ret = hhvm_handlebars_ast_node_to_array(ctx->program);
@@ -557,9 +919,9 @@ static inline Variant hhvm_handlebars_parse_print(const String& tmpl, bool excep
     Variant ret;
     if( ctx->error != NULL ) {
         ret = false;
-        handlebars_last_error.assign(handlebars_context_get_errmsg(ctx));
+        hhvm_handlebars_set_parse_error(ctx);
 	    if( exceptions ) {
-            throw Object(AllocHandlebarsExceptionObject(s_HandlebarsParseExceptionClass, handlebars_last_error));
+            throw hhvm_handlebars_last_error_exception(s_HandlebarsParseExceptionClass);
         }
     } else {
         char * output = handlebars_ast_print(ctx->program, 0);
@@ -600,10 +962,10 @@ static inline Variant hhvm_handlebars_compile(const String& tmpl, int64_t flags,
     Variant ret;
     if( ctx->error != NULL ) {
         ret = false;
-        handlebars_last_error.assign(ctx->error);
+        hhvm_handlebars_set_parse_error(ctx);
 	    if( exceptions ) {
             // @todo this should probably be a ParseException
-            throw Object(AllocHandlebarsExceptionObject(s_HandlebarsParseExceptionClass, handlebars_last_error));
+            throw hhvm_handlebars_last_error_exception(s_HandlebarsParseExceptionClass);
         }
         goto error;
     }
@@ -612,9 +974,9 @@ static inline Variant hhvm_handlebars_compile(const String& tmpl, int64_t flags,
     if( compiler->errnum ) {
         ret = false;
         if( compiler->error ) {
-            handlebars_last_error.assign(ctx->error);
+            hhvm_handlebars_set_compile_error(compiler);
 	        if( exceptions ) {
-                throw Object(AllocHandlebarsExceptionObject(s_HandlebarsCompileExceptionClass, handlebars_last_error));
+                throw hhvm_handlebars_last_error_exception(s_HandlebarsCompileExceptionClass);
             }
         }
         goto error;
@@ -657,10 +1019,10 @@ static inline Variant hhvm_handlebars_compile_print(const String& tmpl, int64_t
     Variant ret;
     if( ctx->error != NULL ) {
         ret = false;
-        handlebars_last_error.assign(ctx->error);
+        hhvm_handlebars_set_parse_error(ctx);
 	    if( exceptions ) {
             // @todo this should probably be a ParseException
-            throw Object(AllocHandlebarsExceptionObject(s_HandlebarsParseExceptionClass, handlebars_last_error));
+            throw hhvm_handlebars_last_error_exception(s_HandlebarsParseExceptionClass);
         }
         goto error;
     }
@@ -669,9 +1031,9 @@ static inline Variant hhvm_handlebars_compile_print(const String& tmpl, int64_t
     if( compiler->errnum ) {
         ret = false;
         if( compiler->error ) {
-            handlebars_last_error.assign(ctx->error);
+            hhvm_handlebars_set_compile_error(compiler);
 	        if( exceptions ) {
-                throw Object(AllocHandlebarsExceptionObject(s_HandlebarsCompileExceptionClass, handlebars_last_error));
+                throw hhvm_handlebars_last_error_exception(s_HandlebarsCompileExceptionClass);
             }
         }
         goto error;
@@ -705,6 +1067,360 @@ Variant HHVM_STATIC_METHOD(HandlebarsNative, version) {
 }
 
 /* }}} handlebars_version */
+/* {{{ Render profiler */
+
+/**
+ * Request-local profiler fed by the renderer (handlebars.php) around helper,
+ * partial and block program calls. Sampling is decided per outermost frame,
+ * so a sampled render is always recorded as a whole tree. Times are self
+ * times, keyed by the folded stack ("a;b;c").
+ *
+ * enter() returns the depth before the frame was opened, and leave() unwinds
+ * back to that depth, closing any frames left open in between (e.g. by a
+ * helper that threw), so one unbalanced call can't skew the rest of the
+ * request.
+ */
+struct HandlebarsProfiler final : RequestEventHandler {
+    struct Frame {
+        size_t pathLength;
+        std::chrono::steady_clock::time_point start;
+        int64_t childNs;
+    };
+
+    struct Stats {
+        int64_t selfNs;
+        int64_t calls;
+    };
+
+    bool enabled;
+    int64_t sampleRate;
+    int64_t rootCount;
+    int64_t depth;
+    bool skipping;
+    std::string path;
+    std::vector<Frame> stack;
+    std::map<std::string, Stats> stats;
+
+    HandlebarsProfiler() { reset(); }
+
+    void requestInit() override { reset(); }
+    void requestShutdown() override { reset(); }
+
+    void reset() {
+        enabled = false;
+        sampleRate = 1;
+        rootCount = 0;
+        depth = 0;
+        skipping = false;
+        path.clear();
+        stack.clear();
+        stats.clear();
+    }
+
+    int64_t enter(const String& frame) {
+        int64_t token = depth++;
+
+        if( token == 0 ) {
+            skipping = (rootCount++ % sampleRate) != 0;
+        }
+        if( skipping ) {
+            return token;
+        }
+
+        Frame f;
+        f.pathLength = path.length();
+        f.childNs = 0;
+        if( !path.empty() ) {
+            path.push_back(';');
+        }
+        // ';' and ' ' are the folded format separators
+        const char * data = frame.data();
+        for( int i = 0; i < frame.size(); i++ ) {
+            path.push_back(data[i] == ';' || data[i] == ' ' ? '_' : data[i]);
+        }
+        f.start = std::chrono::steady_clock::now();
+        stack.push_back(f);
+
+        return token;
+    }
+
+    void leave(int64_t token) {
+        // Stale token, e.g. from before a restart: nothing to unwind
+        if( token < 0 || token >= depth ) {
+            return;
+        }
+
+        while( depth > token ) {
+            depth--;
+            if( !skipping ) {
+                pop();
+            }
+        }
+
+        if( depth == 0 ) {
+            skipping = false;
+        }
+    }
+
+    void pop() {
+        Frame f = stack.back();
+        stack.pop_back();
+
+        int64_t elapsedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - f.start).count();
+        Stats & s = stats[path];
+        s.selfNs += elapsedNs - f.childNs;
+        s.calls++;
+        if( !stack.empty() ) {
+            stack.back().childNs += elapsedNs;
+        }
+
+        path.resize(f.pathLength);
+    }
+
+    String dump(bool calls) const {
+        std::string output;
+        for( auto & it : stats ) {
+            output.append(it.first);
+            output.push_back(' ');
+            output.append(std::to_string(calls ? it.second.calls : it.second.selfNs));
+            output.push_back('\n');
+        }
+        return String(output);
+    }
+};
+
+IMPLEMENT_STATIC_REQUEST_LOCAL(HandlebarsProfiler, s_handlebars_profiler);
+
+void HHVM_STATIC_METHOD(HandlebarsNative, profilerStart, int64_t sampleRate) {
+    s_handlebars_profiler->reset();
+    s_handlebars_profiler->enabled = true;
+    s_handlebars_profiler->sampleRate = sampleRate > 0 ? sampleRate : 1;
+}
+
+void HHVM_STATIC_METHOD(HandlebarsNative, profilerStop) {
+    s_handlebars_profiler->enabled = false;
+}
+
+bool HHVM_STATIC_METHOD(HandlebarsNative, profilerEnabled) {
+    return s_handlebars_profiler->enabled;
+}
+
+int64_t HHVM_STATIC_METHOD(HandlebarsNative, profilerEnter, const String& frame) {
+    if( s_handlebars_profiler->enabled ) {
+        return s_handlebars_profiler->enter(frame);
+    }
+    return -1;
+}
+
+void HHVM_STATIC_METHOD(HandlebarsNative, profilerLeave, int64_t depth) {
+    if( s_handlebars_profiler->enabled ) {
+        s_handlebars_profiler->leave(depth);
+    }
+}
+
+String HHVM_STATIC_METHOD(HandlebarsNative, profilerDump, bool calls) {
+    return s_handlebars_profiler->dump(calls);
+}
+
+/* }}} Render profiler */
+/* {{{ Template store */
+
+/**
+ * Process-wide store of compiled templates, shared by all request threads.
+ * Each version of the store is an immutable, name-sorted table of uncounted
+ * arrays, published with an atomic pointer swap, so reads take no lock,
+ * touch no refcounts and allocate nothing. Writers copy the table under a
+ * mutex, publish the new version, and hand the old table and any replaced
+ * array to the treadmill, which frees them once every request that could
+ * still be using them has finished.
+ */
+typedef std::vector<std::pair<std::string, ArrayData *>> HandlebarsTemplateMap;
+
+static std::atomic<const HandlebarsTemplateMap *> s_handlebars_store(nullptr);
+static std::mutex s_handlebars_store_mutex;
+
+static inline bool hhvm_handlebars_store_entry_less(const HandlebarsTemplateMap::value_type & entry, folly::StringPiece name) {
+    return folly::StringPiece(entry.first) < name;
+}
+
+static inline HandlebarsTemplateMap::const_iterator hhvm_handlebars_store_find(const HandlebarsTemplateMap & map, folly::StringPiece name) {
+    auto it = std::lower_bound(map.begin(), map.end(), name, hhvm_handlebars_store_entry_less);
+    if( it != map.end() && folly::StringPiece(it->first) == name ) {
+        return it;
+    }
+    return map.end();
+}
+
+struct hhvm_handlebars_store_frame {
+    Array src;
+    size_t count;
+    bool expanded;
+};
+
+/**
+ * Deep copy arr into plain packed/mixed arrays, which is all MakeUncounted()
+ * accepts; APC-local, globals and proxy arrays are rebuilt rather than passed
+ * through. Like the AST and compiler converters this uses an explicit work
+ * stack, and each level is allocated at its final size. Returns false if arr
+ * holds objects, resources or references.
+ */
+static bool hhvm_handlebars_store_copy(const Array & arr, Array & out) {
+    std::vector<hhvm_handlebars_store_frame> work;
+    std::vector<Array> values;
+
+    work.push_back({arr, 0, false});
+
+    while( !work.empty() ) {
+        size_t top = work.size() - 1;
+
+        if( !work[top].expanded ) {
+            // Pushing may reallocate the stack, so don't hold references into it
+            Array src = work[top].src;
+            size_t base = work.size();
+            for( ArrayIter iter(src); iter; ++iter ) {
+                // Singly-held refs are flattened below; shared ones can't be
+                if( iter.secondRef().isReferenced() ) {
+                    return false;
+                }
+                const Variant& value(iter.secondRefPlus());
+                if( value.isArray() ) {
+                    work.push_back({value.toArray(), 0, false});
+                } else if( value.isObject() || value.isResource() ) {
+                    return false;
+                }
+            }
+            // Reverse so the child arrays are converted in order
+            std::reverse(work.begin() + base, work.end());
+            work[top].expanded = true;
+            work[top].count = work.size() - base;
+            continue;
+        }
+
+        hhvm_handlebars_store_frame frame = std::move(work.back());
+        work.pop_back();
+
+        size_t base = values.size() - frame.count;
+        const Array * child = values.data() + base;
+        Array result;
+
+        if( frame.src.get()->isVectorData() ) {
+            PackedArrayInit init(frame.src.size());
+            for( ArrayIter iter(frame.src); iter; ++iter ) {
+                const Variant& value(iter.secondRefPlus());
+                if( value.isArray() ) {
+                    init.append(*child++);
+                } else {
+                    init.append(value);
+                }
+            }
+            result = init.toArray();
+        } else {
+            MixedArrayInit init(frame.src.size());
+            for( ArrayIter iter(frame.src); iter; ++iter ) {
+                const Variant& value(iter.secondRefPlus());
+                if( value.isArray() ) {
+                    init.set(iter.first(), *child++, true);
+                } else {
+                    init.set(iter.first(), value, true);
+                }
+            }
+            result = init.toArray();
+        }
+
+        values.resize(base);
+        values.push_back(std::move(result));
+    }
+
+    out = values.back();
+    return true;
+}
+
+static ArrayData * hhvm_handlebars_store_make_uncounted(const Array & arr) {
+    ArrayData * ad = arr.get();
+    if( ad->isStatic() ) {
+        return ad;
+    }
+    assert(ad->isPacked() || ad->isMixed());
+    return ad->isPacked() ? PackedArray::MakeUncounted(ad) : MixedArray::MakeUncounted(ad);
+}
+
+static void hhvm_handlebars_store_release_uncounted(ArrayData * ad) {
+    if( ad->isStatic() ) {
+        return;
+    }
+    if( ad->isPacked() ) {
+        PackedArray::ReleaseUncounted(ad);
+    } else {
+        MixedArray::ReleaseUncounted(ad);
+    }
+}
+
+/**
+ * Publish a new version of the store with name set to ad, or removed if ad
+ * is NULL. Returns true if name was previously present.
+ */
+static bool hhvm_handlebars_store_publish(const String & name, ArrayData * ad) {
+    std::lock_guard<std::mutex> lock(s_handlebars_store_mutex);
+
+    folly::StringPiece key(name.data(), name.size());
+    const HandlebarsTemplateMap * old = s_handlebars_store.load(std::memory_order_relaxed);
+    HandlebarsTemplateMap * next = old ? new HandlebarsTemplateMap(*old) : new HandlebarsTemplateMap();
+    ArrayData * replaced = NULL;
+
+    auto it = std::lower_bound(next->begin(), next->end(), key, hhvm_handlebars_store_entry_less);
+    if( it != next->end() && folly::StringPiece(it->first) == key ) {
+        replaced = it->second;
+        if( ad ) {
+            it->second = ad;
+        } else {
+            next->erase(it);
+        }
+    } else if( ad ) {
+        next->emplace(it, name.toCppString(), ad);
+    }
+
+    s_handlebars_store.store(next, std::memory_order_release);
+
+    if( old || replaced ) {
+        Treadmill::enqueue([old, replaced] {
+            delete old;
+            if( replaced ) {
+                hhvm_handlebars_store_release_uncounted(replaced);
+            }
+        });
+    }
+
+    return replaced != NULL;
+}
+
+void HHVM_STATIC_METHOD(HandlebarsNative, storeSet, const String& name, const Array& compiled) {
+    Array copy;
+    if( !hhvm_handlebars_store_copy(compiled, copy) ) {
+        throw Object(AllocHandlebarsExceptionObject(s_HandlebarsExceptionClass,
+                String("Template store entries may not contain objects, resources or references")));
+    }
+    hhvm_handlebars_store_publish(name, hhvm_handlebars_store_make_uncounted(copy));
+}
+
+Variant HHVM_STATIC_METHOD(HandlebarsNative, storeGet, const String& name) {
+    Variant ret;
+    const HandlebarsTemplateMap * map = s_handlebars_store.load(std::memory_order_acquire);
+    if( map ) {
+        auto it = hhvm_handlebars_store_find(*map, folly::StringPiece(name.data(), name.size()));
+        if( it != map->end() ) {
+            // Uncounted, so this doesn't touch the shared refcount
+            ret = Array(it->second);
+        }
+    }
+    return ret;
+}
+
+bool HHVM_STATIC_METHOD(HandlebarsNative, storeDelete, const String& name) {
+    return hhvm_handlebars_store_publish(name, NULL);
+}
+
+/* }}} Template store */
 
 static class HandlebarsExtension : public Extension {
     public:
@@ -720,6 +1436,7 @@ static class HandlebarsExtension : public Extension {
     	HBS_HHVM_CONST_INT("Handlebars\\COMPILER_FLAG_ALL", handlebars_compiler_flag_all);
 
         HHVM_FE(handlebars_error);
+        HHVM_FE(handlebars_error_location);
         HHVM_FE(handlebars_lex);
         HHVM_FE(handlebars_lex_print);
         HHVM_FE(handlebars_parse);
@@ -729,6 +1446,7 @@ static class HandlebarsExtension : public Extension {
         HHVM_FE(handlebars_version);
 
         HHVM_STATIC_ME(HandlebarsNative, getLastError);
+        HHVM_STATIC_ME(HandlebarsNative, getLastErrorLocation);
         HHVM_STATIC_ME(HandlebarsNative, lex);
         HHVM_STATIC_ME(HandlebarsNative, lexPrint);
         HHVM_STATIC_ME(HandlebarsNative, parse);
@@ -736,6 +1454,15 @@ static class HandlebarsExtension : public Extension {
         HHVM_STATIC_ME(HandlebarsNative, compile);
         HHVM_STATIC_ME(HandlebarsNative, compilePrint);
         HHVM_STATIC_ME(HandlebarsNative, version);
+        HHVM_STATIC_ME(HandlebarsNative, profilerStart);
+        HHVM_STATIC_ME(HandlebarsNative, profilerStop);
+        HHVM_STATIC_ME(HandlebarsNative, profilerEnabled);
+        HHVM_STATIC_ME(HandlebarsNative, profilerEnter);
+        HHVM_STATIC_ME(HandlebarsNative, profilerLeave);
+        HHVM_STATIC_ME(HandlebarsNative, profilerDump);
+        HHVM_STATIC_ME(HandlebarsNative, storeSet);
+        HHVM_STATIC_ME(HandlebarsNative, storeGet);
+        HHVM_STATIC_ME(HandlebarsNative, storeDelete);
 
         loadSystemlib();
 